@@ -0,0 +1,48 @@
+// Moke - Windows+Alt Keys As Mouse Emulation -*- mode:c++ -*-
+// Copyright (C) 2021 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+// Binary form of a configuration, produced by `moke --compile' and
+// mapped by `moke -c'.  An ImageHeader is followed by numButtons
+// ImageButton records and then the NUL-terminated strings.  There are
+// no pointers, everything is located by its offset from the start of
+// the image, so it may be mapped anywhere.  The buttons have already
+// been checked, and their overrides computed.  Everything is native
+// endian.
+
+#ifndef MOKE_IMAGE_H
+#define MOKE_IMAGE_H
+
+unsigned const imageMagic = 0x4d494b4d; // "MKIM"
+unsigned const imageVersion = 1;
+
+enum ImageFlags
+{
+  IF_Tap = 1 << 0,      // -t
+  IF_Threaded = 1 << 1, // -T
+  IF_Verbose = 1 << 2,  // -v
+};
+
+struct ImageHeader
+{
+  unsigned magic;
+  unsigned version;
+  unsigned size;       // of the whole image
+  unsigned flags;      // ImageFlags
+  unsigned keyboard;   // offset of the keyboard name, or zero
+  unsigned device;     // offset of the uinput device, or zero
+  unsigned timings;    // offset of the timings file (-s), or zero
+  unsigned numButtons;
+  unsigned buttons;    // offset of the ImageButton records
+};
+
+struct ImageButton
+{
+  unsigned short mouse;    // the mouse BTN to emit
+  unsigned short key;      // the keyboard KEY we want
+  unsigned short mod;      // keyboard modifier, if any
+  unsigned short override; // one more than the index of the
+			   // non-modified button this overrides, or zero
+};
+
+#endif
@@ -0,0 +1,64 @@
+// Moke - Windows+Alt Keys As Mouse Emulation -*- mode:c++ -*-
+// Copyright (C) 2021 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+// The event tap.  Moke publishes the events it reads and writes to a
+// ring in shared memory, which any number of local readers may
+// consume.  There is a single producer that never waits for
+// readers.  Each slot carries a sequence number, which readers use to
+// detect that they have been lapped.  Readers hold a shared flock on
+// the tap while attached, so the producer can tell when they have all
+// gone, even if they were killed.
+
+#ifndef MOKE_TAP_H
+#define MOKE_TAP_H
+
+#include <linux/input.h>
+
+auto const &tapName = "/moke-tap"; // shm_open name
+
+unsigned const tapMagic = 0x5041544d; // "MTAP"
+unsigned const tapVersion = 2;
+unsigned const tapSlots = 4096; // must be a power of 2
+
+enum TapDir
+{
+  TD_In,  // read from the keyboard
+  TD_Out, // written to the Moke device
+};
+
+struct TapRing
+{
+  unsigned magic;   // written last, once the ring is initialized
+  unsigned version;
+  unsigned slots;   // number of slots following the header
+  int pid;          // of the publisher
+  unsigned readers; // set by readers once locked, cleared by the
+		    // publisher once unlocked.  Publishing stops when zero
+
+  // The number of events published, in its own cache line.
+  alignas (64) unsigned long long head;
+};
+
+struct TapSlot
+{
+  // Sequence for event N is 2N+1 while being written and 2N+2 once
+  // complete.
+  unsigned long long seq;
+  unsigned dir; // TapDir
+  input_event event;
+};
+
+inline TapSlot *
+TapSlots (TapRing *ring)
+{
+  return reinterpret_cast<TapSlot *> (ring + 1);
+}
+
+inline unsigned long
+TapSize (unsigned slots)
+{
+  return sizeof (TapRing) + slots * sizeof (TapSlot);
+}
+
+#endif
@@ -0,0 +1,48 @@
+// Moke - Windows+Alt Keys As Mouse Emulation -*- mode:c++ -*-
+// Copyright (C) 2021 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+// Binary form of the typing dynamics moke collects with `-s'.  A
+// TimingsHeader is followed by numKeys TimingsKey records (only keys
+// that have been pressed) and then numChords TimingsChord records
+// (the mappings with a modifier).  Histogram bucket 0 counts
+// intervals under 1us, and bucket N counts those in [2^(N-1), 2^N)
+// us.  The last bucket also counts anything longer.  Everything is
+// native endian.
+
+#ifndef MOKE_TIMINGS_H
+#define MOKE_TIMINGS_H
+
+unsigned const timingsMagic = 0x59444b4d; // "MKDY"
+unsigned const timingsVersion = 2;
+unsigned const timingsBuckets = 32;
+
+struct TimingsHeader
+{
+  unsigned magic;
+  unsigned version;
+  unsigned buckets;
+  unsigned numKeys;
+  unsigned numChords;
+};
+
+struct TimingsKey
+{
+  unsigned short code;
+  unsigned short pad;
+  unsigned dwell[timingsBuckets];  // press to release
+  unsigned flight[timingsBuckets]; // previous key press to this press
+};
+
+struct TimingsChord
+{
+  unsigned short mouse;
+  unsigned short key;
+  unsigned short mod;
+  unsigned short pad;
+  unsigned lead[timingsBuckets];    // key press to modifier press
+  unsigned modLead[timingsBuckets]; // the same, modifier pressed first
+  unsigned overlap[timingsBuckets]; // both pressed to either released
+};
+
+#endif
@@ -0,0 +1,226 @@
+// Moke Tap - Watch Moke's Events -*- mode:c++ -*-
+// Copyright (C) 2021 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+// Like moke, this is C++ syntax with only the C runtime.
+
+#include "mokecfg.h"
+#include "tap.h"
+// C
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+// OS
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+char const *progName = "";
+volatile sig_atomic_t stopping = 0;
+
+void
+Inform (char const *fmt, ...)
+{
+  va_list args;
+  fprintf (stderr, "%s:", progName);
+  va_start (args, fmt);
+  vfprintf (stderr, fmt, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+}
+
+void
+Stop (int)
+{
+  stopping = 1;
+}
+
+char const *
+TypeName (unsigned type)
+{
+  switch (type)
+    {
+    case EV_SYN:
+      return "SYN";
+    case EV_KEY:
+      return "KEY";
+    case EV_MSC:
+      return "MSC";
+    case EV_LED:
+      return "LED";
+    case EV_REP:
+      return "REP";
+    default:
+      return nullptr;
+    }
+}
+
+void
+Print (TapSlot const &slot)
+{
+  auto const &ev = slot.event;
+
+  printf ("%-3s %ld.%06ld ", slot.dir == TD_In ? "in" : "out",
+	  long (ev.input_event_sec), long (ev.input_event_usec));
+  if (auto *name = TypeName (ev.type))
+    printf ("%s", name);
+  else
+    printf ("%u", ev.type);
+  printf (" %u %d\n", ev.code, ev.value);
+}
+
+void
+Usage (FILE *stream = stderr)
+{
+  fprintf (stream, R"(Moke Tap: Watch Moke's Events
+  Usage: %s [OPTIONS]
+
+Print the events a running moke reads from the keyboard and writes to
+its device.  Moke must have been started with `-t'.  Should we fall
+behind, the number of events missed is reported.  We exit when moke
+does.
+
+Options:
+  -h	Help
+  -i	Only show input events
+  -o	Only show output events
+)",
+	   progName);
+  fprintf (stream, "\nVersion %s.\n", PROJECT_NAME " " PROJECT_VERSION);
+  if (PROJECT_URL[0])
+    fprintf (stream, "See %s for more information.\n", PROJECT_URL);
+}
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  if (auto const *pName = argv[0])
+    {
+      // set progName
+      if (auto *slash = strrchr (pName, '/'))
+	pName = slash + 1;
+      progName = pName;
+    }
+
+  bool show[2] = {true, true};
+  for (int argno = 1; argno < argc; argno++)
+    {
+      auto *arg = argv[argno];
+      if (!strcmp (arg, "-h"))
+	{
+	  Usage (stdout);
+	  return 0;
+	}
+      else if (!strcmp (arg, "-i"))
+	show[TD_Out] = false;
+      else if (!strcmp (arg, "-o"))
+	show[TD_In] = false;
+      else
+	{
+	  Inform ("unknown argument `%s'", arg);
+	  Usage ();
+	  return 1;
+	}
+    }
+
+  int fd = shm_open (tapName, O_RDWR, 0);
+  if (fd < 0)
+    {
+      Inform ("cannot open tap `%s': %m (is moke running with -t?)",
+	      tapName);
+      return 1;
+    }
+
+  void *map = MAP_FAILED;
+  struct stat info;
+  if (!fstat (fd, &info) && unsigned (info.st_size) >= sizeof (TapRing))
+    map = mmap (nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+  auto *ring = static_cast<TapRing *> (map);
+  if (map == MAP_FAILED
+      || __atomic_load_n (&ring->magic, __ATOMIC_ACQUIRE) != tapMagic
+      || ring->version != tapVersion
+      || TapSize (ring->slots) != (unsigned long) (info.st_size)
+      || (ring->slots & (ring->slots - 1)))
+    {
+      Inform ("tap `%s' is not usable", tapName);
+      return 1;
+    }
+
+  signal (SIGHUP, Stop);
+  signal (SIGINT, Stop);
+  signal (SIGTERM, Stop);
+  signal (SIGPIPE, Stop);
+  int pid = ring->pid;
+  Inform ("attached to moke (pid %d)", pid);
+
+  // Our lock tells moke we are here.  It is released when we exit,
+  // however that happens.
+  if (flock (fd, LOCK_SH) < 0)
+    {
+      Inform ("cannot lock tap `%s': %m", tapName);
+      return 1;
+    }
+  __atomic_store_n (&ring->readers, 1, __ATOMIC_RELEASE);
+
+  auto *slots = TapSlots (ring);
+  auto mask = ring->slots - 1;
+  unsigned long long lost = 0;
+  unsigned naps = 0;
+  for (auto next = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+       !stopping;)
+    {
+      auto head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+      if (next == head)
+	{
+	  fflush (stdout);
+	  // Once a second, check moke is still there.  When it exits
+	  // the tap is unlinked, and nothing more will arrive.
+	  if (!(++naps % 1000) && kill (pid, 0) < 0 && errno == ESRCH)
+	    {
+	      Inform ("moke (pid %d) has exited", pid);
+	      break;
+	    }
+	  timespec nap {0, 1000000};
+	  nanosleep (&nap, nullptr);
+	  continue;
+	}
+
+      if (head - next > ring->slots)
+	{
+	  // Lapped, skip to the oldest event still present
+	  lost += head - next - ring->slots;
+	  next = head - ring->slots;
+	}
+
+      auto &slot = slots[next & mask];
+      auto seq = __atomic_load_n (&slot.seq, __ATOMIC_ACQUIRE);
+      TapSlot copy = slot;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (seq != next * 2 + 2
+	  || __atomic_load_n (&slot.seq, __ATOMIC_RELAXED) != seq)
+	// Overwritten while we were looking
+	lost++;
+      else
+	{
+	  if (lost)
+	    {
+	      Inform ("lost %llu events", lost);
+	      lost = 0;
+	    }
+	  if (copy.dir <= TD_Out && show[copy.dir])
+	    Print (copy);
+	}
+      next++;
+    }
+
+  return 0;
+}